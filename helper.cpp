@@ -65,6 +65,32 @@ uint8_t fix(float capme)
         return 255;
     return (int8_t)capme;
 }
+// Same, but to 0~65535.
+uint16_t fix16(float capme)
+{
+    capme *= 65535;
+    capme += 0.5;
+    if(capme < 0)
+        return 0;
+    if(capme > 65535)
+        return 65535;
+    return (uint16_t)capme;
+}
+
+// Slurps a whole file. Returns false if it can't be opened.
+bool readfile(const char * filename, std::vector<uint8_t>& bytes)
+{
+    FILE* file = fopen(filename, "rb");
+    if(file == NULL)
+        return false;
+    bytes.clear();
+    uint8_t buffer[65536];
+    size_t got;
+    while((got = fread(buffer, 1, sizeof(buffer), file)) > 0)
+        bytes.insert(bytes.end(), buffer, buffer+got);
+    fclose(file);
+    return true;
+}
 
 float tolinear(float srgb)
 {
@@ -244,7 +270,8 @@ struct image
     {
         width = arg_width;
         height = arg_height;
-        data = std::vector<triad>();
+        // clear() keeps the allocation around, so reused images don't hit the allocator.
+        data.clear();
         data.resize(width*height);
     }
     
@@ -328,7 +355,269 @@ struct image
         else
             puts("Error opening file.");
     }
-    void readff(const char * filename)
+    // QOI, see https://qoiformat.org/qoi-specification.pdf
+    // It's 8 bits per channel only; use farbfeld if you need more.
+    //
+    // The encoder works in horizontal stripes that can be encoded independently
+    // and concatenated by stitchqoi(). That works because each stripe starts
+    // with a full QOI_OP_RGB pixel, never emits a run that crosses into it,
+    // and only indexes colors it has itself put in the color table. Whatever
+    // state a decoder has left over from the previous stripe never matters.
+    // The result is a completely normal QOI file.
+    void encodeqoi_stripe(unsigned top, unsigned bottom, std::vector<uint8_t>& bytes)
+    {
+        bytes.clear();
+        bytes.reserve((bottom-top)*width*4);
+        uint8_t index[64][3] = {};
+        bool used[64] = {};
+        uint8_t prev[3] = {0, 0, 0};
+        bool first = true;
+        unsigned run = 0;
+        for(unsigned i = top*width; i < bottom*width; i++)
+        {
+            uint8_t px[3] = {fix(data[i].r), fix(data[i].g), fix(data[i].b)};
+            if(!first and memcmp(px, prev, 3) == 0)
+            {
+                run++;
+                if(run == 62)
+                {
+                    bytes.push_back(0xC0 | (run-1)); // QOI_OP_RUN
+                    run = 0;
+                }
+                continue;
+            }
+            if(run > 0)
+            {
+                bytes.push_back(0xC0 | (run-1));
+                run = 0;
+            }
+            
+            unsigned hash = (px[0]*3 + px[1]*5 + px[2]*7 + 255*11)%64;
+            if(used[hash] and memcmp(index[hash], px, 3) == 0)
+                bytes.push_back(hash); // QOI_OP_INDEX
+            else
+            {
+                memcpy(index[hash], px, 3);
+                used[hash] = true;
+                
+                int8_t dr = px[0]-prev[0];
+                int8_t dg = px[1]-prev[1];
+                int8_t db = px[2]-prev[2];
+                int8_t dr_dg = dr-dg;
+                int8_t db_dg = db-dg;
+                if(!first and dr >= -2 and dr <= 1 and dg >= -2 and dg <= 1 and db >= -2 and db <= 1)
+                    bytes.push_back(0x40 | (dr+2)<<4 | (dg+2)<<2 | (db+2)); // QOI_OP_DIFF
+                else if(!first and dg >= -32 and dg <= 31 and dr_dg >= -8 and dr_dg <= 7 and db_dg >= -8 and db_dg <= 7)
+                {
+                    bytes.push_back(0x80 | (dg+32)); // QOI_OP_LUMA
+                    bytes.push_back((dr_dg+8)<<4 | (db_dg+8));
+                }
+                else
+                {
+                    bytes.push_back(0xFE); // QOI_OP_RGB
+                    bytes.push_back(px[0]);
+                    bytes.push_back(px[1]);
+                    bytes.push_back(px[2]);
+                }
+            }
+            memcpy(prev, px, 3);
+            first = false;
+        }
+        if(run > 0)
+            bytes.push_back(0xC0 | (run-1));
+    }
+    // Wraps encoded stripes, top to bottom, into a QOI file.
+    void stitchqoi(const std::vector<std::vector<uint8_t>>& stripes, std::vector<uint8_t>& bytes)
+    {
+        size_t size = 14+8;
+        for(auto& stripe : stripes)
+            size += stripe.size();
+        bytes.clear();
+        bytes.reserve(size);
+        const uint8_t header[14] = {'q', 'o', 'i', 'f',
+            uint8_t(width>>24), uint8_t(width>>16), uint8_t(width>>8), uint8_t(width),
+            uint8_t(height>>24), uint8_t(height>>16), uint8_t(height>>8), uint8_t(height),
+            3, 0}; // RGB, sRGB
+        bytes.insert(bytes.end(), header, header+14);
+        for(auto& stripe : stripes)
+            bytes.insert(bytes.end(), stripe.begin(), stripe.end());
+        const uint8_t end[8] = {0, 0, 0, 0, 0, 0, 0, 1};
+        bytes.insert(bytes.end(), end, end+8);
+    }
+    void encodeqoi(std::vector<uint8_t>& bytes)
+    {
+        std::vector<std::vector<uint8_t>> stripes(1);
+        encodeqoi_stripe(0, height, stripes[0]);
+        stitchqoi(stripes, bytes);
+    }
+    // Parses an in-memory QOI file. Alpha is dropped. If table is given, it
+    // maps 16-bit channel values to floats, same as decodeff(). Images over
+    // max_pixels are refused before anything is allocated for them.
+    bool decodeqoi(const std::vector<uint8_t>& bytes, const float* table = nullptr, uint64_t max_pixels = 400000000)
+    {
+        if(bytes.size() < 14+8 or memcmp(bytes.data(), "qoif", 4) != 0)
+            return false;
+        auto be32 = [&](size_t i)
+        {
+            return (uint32_t(bytes[i])<<24)|(uint32_t(bytes[i+1])<<16)|(uint32_t(bytes[i+2])<<8)|uint32_t(bytes[i+3]);
+        };
+        uint32_t w = be32(4);
+        uint32_t h = be32(8);
+        // Each byte decodes to at most 62 pixels, and the spec caps the total.
+        if(w == 0 or h == 0 or (uint64_t)w*h > std::min<uint64_t>(max_pixels, 400000000) or (uint64_t)w*h > (uint64_t)bytes.size()*62)
+            return false;
+        // Decode on the side so a truncated stream leaves this image alone.
+        std::vector<triad> pixels((size_t)w*h);
+        
+        uint8_t index[64][4] = {};
+        uint8_t px[4] = {0, 0, 0, 255};
+        size_t p = 14;
+        size_t end = bytes.size()-8;
+        unsigned run = 0;
+        for(auto& t : pixels)
+        {
+            if(run > 0)
+                run--;
+            else
+            {
+                if(p >= end)
+                    return false;
+                uint8_t b1 = bytes[p++];
+                if(b1 == 0xFE or b1 == 0xFF) // QOI_OP_RGB, QOI_OP_RGBA
+                {
+                    unsigned count = b1 == 0xFE ? 3 : 4;
+                    if(p+count > end)
+                        return false;
+                    memcpy(px, &bytes[p], count);
+                    p += count;
+                }
+                else if((b1 & 0xC0) == 0x00) // QOI_OP_INDEX
+                    memcpy(px, index[b1], 4);
+                else if((b1 & 0xC0) == 0x40) // QOI_OP_DIFF
+                {
+                    px[0] += ((b1>>4)&3) - 2;
+                    px[1] += ((b1>>2)&3) - 2;
+                    px[2] += ( b1    &3) - 2;
+                }
+                else if((b1 & 0xC0) == 0x80) // QOI_OP_LUMA
+                {
+                    if(p >= end)
+                        return false;
+                    uint8_t b2 = bytes[p++];
+                    int dg = (b1&0x3F) - 32;
+                    px[0] += dg - 8 + ((b2>>4)&0xF);
+                    px[1] += dg;
+                    px[2] += dg - 8 + (b2&0xF);
+                }
+                else // QOI_OP_RUN
+                    run = b1&0x3F;
+                memcpy(index[(px[0]*3 + px[1]*5 + px[2]*7 + px[3]*11)%64], px, 4);
+            }
+            if(table)
+            {
+                // v/255 == v*257/65535, so 8-bit values land exactly on the 16-bit table.
+                t.r = table[px[0]*257];
+                t.g = table[px[1]*257];
+                t.b = table[px[2]*257];
+            }
+            else
+            {
+                t.r = px[0]*1.0/0xFF;
+                t.g = px[1]*1.0/0xFF;
+                t.b = px[2]*1.0/0xFF;
+            }
+        }
+        width = w;
+        height = h;
+        data.swap(pixels);
+        return true;
+    }
+    // encoded, if given, must already be this image as QOI (e.g. encoded in
+    // parallel). Always appends .qoi so we never overwrite a .qoi input.
+    void writeqoi(const char * filename, const std::vector<uint8_t>* encoded = nullptr)
+    {
+        std::string temp(filename);
+        temp += ".qoi";
+        filename = temp.data();
+        
+        std::vector<uint8_t> bytes;
+        if(encoded == nullptr)
+        {
+            encodeqoi(bytes);
+            encoded = &bytes;
+        }
+        
+        FILE* file = fopen(filename, "wb");
+        printf("writing file %s\n", filename);
+        if(file != NULL)
+        {
+            printf("w h : %d %d\n", width, height);
+            fwrite(encoded->data(), 1, encoded->size(), file);
+            fclose(file);
+        }
+        else
+            puts("Error opening file.");
+    }
+    // Parses an in-memory farbfeld file. If table is given, it maps raw 16-bit
+    // channel values to floats (e.g. a precomputed gamma curve).
+    bool decodeff(const std::vector<uint8_t>& bytes, const float* table = nullptr, uint64_t max_pixels = UINT64_MAX)
+    {
+        if(bytes.size() < 16 or memcmp(bytes.data(), "farbfeld", 8) != 0)
+            return false;
+        auto be32 = [&](size_t i)
+        {
+            return (uint32_t(bytes[i])<<24)|(uint32_t(bytes[i+1])<<16)|(uint32_t(bytes[i+2])<<8)|uint32_t(bytes[i+3]);
+        };
+        uint32_t w = be32(8);
+        uint32_t h = be32(12);
+        if(w == 0 or h == 0 or (bytes.size()-16)/8/w < h or (uint64_t)w*h > max_pixels)
+            return false;
+        dimensions(w, h);
+        const uint8_t* p = bytes.data()+16;
+        for(auto& t : data)
+        {
+            uint16_t r = (p[0]<<8)|p[1];
+            uint16_t g = (p[2]<<8)|p[3];
+            uint16_t b = (p[4]<<8)|p[5];
+            if(table)
+            {
+                t.r = table[r];
+                t.g = table[g];
+                t.b = table[b];
+            }
+            else
+            {
+                t.r = r*1.0/0xFFFF;
+                t.g = g*1.0/0xFFFF;
+                t.b = b*1.0/0xFFFF;
+            }
+            p += 8;
+        }
+        return true;
+    }
+    // Serializes to an in-memory 16-bit farbfeld file with opaque alpha.
+    void encodeff(std::vector<uint8_t>& bytes)
+    {
+        bytes.resize(16+data.size()*8);
+        memcpy(bytes.data(), "farbfeld", 8);
+        uint8_t* p = bytes.data()+8;
+        auto put16 = [&](uint16_t v)
+        {
+            *p++ = v>>8;
+            *p++ = v&0xFF;
+        };
+        put16(width>>16); put16(width&0xFFFF);
+        put16(height>>16); put16(height&0xFFFF);
+        for(auto& t : data)
+        {
+            put16(fix16(t.r));
+            put16(fix16(t.g));
+            put16(fix16(t.b));
+            put16(0xFFFF);
+        }
+    }
+    
+    bool readff(const char * filename, const float* table = nullptr)
     {
         std::string temp(filename);
         if(temp.size() <= 3)
@@ -344,42 +633,52 @@ struct image
             filename = temp.data();
         }
         
-        FILE* file = fopen(filename, "rb");
+        std::vector<uint8_t> bytes;
         printf("reading file %s\n", filename);
-        if(file != NULL)
+        if(readfile(filename, bytes))
         {
-            char name[8];
-            fread(name, 1, 8, file);
-            printf("%.8s -- header magic\n", name);
-            if(memcmp(name, "farbfeld", 8) == 0)
-            {
-                {
-                    unsigned int scratch[2];
-                    fread(scratch, 4, 2, file);
-                    width = swap32(scratch[0]);
-                    height = swap32(scratch[1]);
-                    
-                    std::cout << width << " " << height << " -- dimensions\n";
-                    
-                    dimensions(width, height);
-                }
-                for(auto& t : data)
-                {
-                    unsigned short scratch[4];
-                    fread(scratch, 2, 4, file);
-                    t.r = swap16(scratch[0])*1.0/0xFFFF;
-                    t.g = swap16(scratch[1])*1.0/0xFFFF;
-                    t.b = swap16(scratch[2])*1.0/0xFFFF;
-                }
-            }
+            printf("%.8s -- header magic\n", bytes.size() >= 8 ? (const char*)bytes.data() : "");
+            if(decodeff(bytes, table))
+                std::cout << width << " " << height << " -- dimensions\n";
             else
+            {
                 puts("Not a valid farbfeld file.");
-        
-            fclose(file);
+                return false;
+            }
             
             std::cout << data.size() << " -- number of pixels in farbfeld\n";
+            return true;
+        }
+        else
+            puts("Error opening file.");
+        return false;
+    }
+    bool readqoi(const char * filename, const float* table = nullptr)
+    {
+        std::vector<uint8_t> bytes;
+        printf("reading file %s\n", filename);
+        if(readfile(filename, bytes))
+        {
+            if(decodeqoi(bytes, table))
+                std::cout << width << " " << height << " -- dimensions\n";
+            else
+            {
+                puts("Not a valid qoi file.");
+                return false;
+            }
+            
+            std::cout << data.size() << " -- number of pixels in qoi\n";
+            return true;
         }
         else
             puts("Error opening file.");
+        return false;
+    }
+    // Either of the above, going by the magic bytes.
+    bool decode(const std::vector<uint8_t>& bytes, const float* table = nullptr, uint64_t max_pixels = 400000000)
+    {
+        if(bytes.size() >= 4 and memcmp(bytes.data(), "qoif", 4) == 0)
+            return decodeqoi(bytes, table, max_pixels);
+        return decodeff(bytes, table, max_pixels);
     }
 };
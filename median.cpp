@@ -1,8 +1,23 @@
-// compile with --std=c++11
+// compile with --std=c++11 -pthread
 
 #include "helper.cpp" 
 
 #include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+
+#include <errno.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 /*
    Copyright 2016 Alexander "wareya" Nadeau <wareya@gmail.com>
@@ -38,110 +53,294 @@ For more information, please refer to <http://unlicense.org/>
 
 // Denoise-dering an image using a weighted median.
 
-int main(int argc, const char* argv[])
+struct filter_options
 {
-    if(argc == 1 or strcmp(argv[1], "--help") == 0 or strcmp(argv[1], "-h") == 0)
+    bool dolinear;
+    int blurry;
+    bool split;
+    bool qoi; // output format, not really a filter option
+    
+    filter_options()
     {
-        puts("Usage: median <filename> [--srgb] [--blurry|blurrier|special] [--split]");
-        puts("<filename> must be a farbfeld image file with the .ff extension present.");
-        puts("If <filename> has an extension, the output will contain it: 'fab.ff.ppm'");
-        puts("The output filename uses the input filename with the ppm file extension.");
-        puts("");
-        puts("All filtering is done in linear RGB by default. Add '--srgb' immediately");
-        puts("after the input filename to filter in sRGB gamma. Sometimes fixes moire.");
-        puts("");
-        puts("'--blurry' makes the filter blend multiple kernel pixel values together.");
-        puts("It's nearly invisible, but *does* smooth certain features very slightly.");
-        puts("");
-        puts("'--blurrier' is like '--blurry', but blends more tentative pixel values.");
-        puts("It's much stronger, and can make or break the filtering of some artwork.");
-        puts("");
-        puts("'--special' does not weight the median but instead blurs the median set.");
-        puts("The median set is blurred with a triangle kernel that catches the edges.");
-        puts("This is done after sorting, so it's different from straightforward blur.");
-        puts("It's almost as sharp as a 2x2 blur but with less noise, and is centered.");
-        puts("");
-        puts("'--split' performs the sorting on each separate RGB channel, rather than");
-        puts("on the broad pixel value as a whole. Good for strong dithered pixel art.");
-        puts("");
-        puts("ppm is a very old text-based image format that is very easy to generate.");
-        puts("For software that can open ppm images, I use KolourPaint, a Paint clone.");
-        puts("");
-        puts("farbfeld is a binary image format. It is very extremely easy to process.");
-        puts("For software for using farbfeld, see http://tools.suckless.org/farbfeld/");
-        return 0;
+        dolinear = true;
+        blurry = 0;
+        split = false;
+        qoi = false;
     }
-    image img;
-    img.readff(argv[1]);
-    image dest;
-    dest.dimensions(img.width, img.height);
-    
-    if(img.width * img.height == 1)
+};
+
+// Recognizes a single filter flag. Returns false if it isn't one.
+bool parse_option(const char* arg, filter_options& options, bool verbose)
+{
+    if(strcmp(arg, "--srgb") == 0)
     {
-        puts("Nothing to do. Image is only one pixel large. Output not written.");
-        return 0;
+        if(verbose) puts("Not using linear RGB.");
+        options.dolinear = false;
+    }
+    else if(strcmp(arg, "--blurry") == 0)
+    {
+        if(verbose) puts("Blurry mode.");
+        options.blurry = 1;
+    }
+    else if(strcmp(arg, "--blurrier") == 0)
+    {
+        if(verbose) puts("Blurrier mode.");
+        options.blurry = 2;
+    }
+    else if(strcmp(arg, "--special") == 0)
+    {
+        if(verbose) puts("Special mode.");
+        options.blurry = 3;
     }
+    else if(strcmp(arg, "--split") == 0)
+    {
+        if(verbose) puts("Split channel mode.");
+        options.split = true;
+    }
+    else if(strcmp(arg, "--qoi") == 0)
+    {
+        if(verbose) puts("QOI output.");
+        options.qoi = true;
+    }
+    else
+        return false;
+    return true;
+}
+
+// Lookup table for the input gamma curve, so we don't call pow() per channel.
+// It's exact because farbfeld only has 65536 possible values. There's no table
+// for the output side: filtered values can be anything, and an interpolated
+// curve occasionally rounds to a different 8-bit value than pow() does.
+struct gammatables
+{
+    std::vector<float> linear; // indexed by raw 16-bit channel value
     
-    puts("Running median");
+    gammatables()
+    {
+        linear.resize(65536);
+        for(unsigned i = 0; i < 65536; i++)
+            linear[i] = tolinear_worse(i*1.0/0xFFFF);
+    }
+};
+
+// Persistent worker threads. run() hands out numbered tasks and blocks until
+// all of them are done. Several callers may use the same pool at once.
+struct workpool
+{
+    std::vector<std::thread> threads;
+    std::deque<std::function<void()>> tasks;
+    std::mutex lock;
+    std::condition_variable wake;
+    bool quit;
     
-    bool dolinear = true;
-    int blurry = 0;
-    bool split = false;
-    int n = 3;
-    if(argc >= n)
+    workpool(unsigned count)
     {
-        if(strcmp(argv[n-1], "--srgb") == 0)
-        {
-            puts("Not using linear RGB.");
-            dolinear = false;
-            n += 1;
-        }
+        quit = false;
+        if(count == 0)
+            count = 1;
+        for(unsigned i = 0; i < count; i++)
+            threads.emplace_back([this]()
+            {
+                while(true)
+                {
+                    std::function<void()> task;
+                    {
+                        std::unique_lock<std::mutex> guard(lock);
+                        wake.wait(guard, [this]{ return quit or !tasks.empty(); });
+                        if(tasks.empty())
+                            return;
+                        task = std::move(tasks.front());
+                        tasks.pop_front();
+                    }
+                    task();
+                }
+            });
     }
-    if(argc >= n)
+    ~workpool()
     {
-        if(strcmp(argv[n-1], "--blurry") == 0)
         {
-            blurry = 1;
-            puts("Blurry mode.");
-            n += 1;
+            std::lock_guard<std::mutex> guard(lock);
+            quit = true;
         }
-        else if(strcmp(argv[n-1], "--blurrier") == 0)
-        {
-            blurry = 2;
-            puts("Blurrier mode.");
-            n += 1;
-        }
-        else if(strcmp(argv[n-1], "--special") == 0)
+        wake.notify_all();
+        for(auto& thread : threads)
+            thread.join();
+    }
+    
+    void run(unsigned count, const std::function<void(unsigned)>& task)
+    {
+        std::mutex donelock;
+        std::condition_variable done;
+        unsigned remaining = count;
         {
-            blurry = 3;
-            puts("Special mode.");
-            n += 1;
+            std::lock_guard<std::mutex> guard(lock);
+            for(unsigned i = 0; i < count; i++)
+                tasks.push_back([&, i]()
+                {
+                    task(i);
+                    std::lock_guard<std::mutex> guard(donelock);
+                    if(--remaining == 0)
+                        done.notify_all();
+                });
         }
+        wake.notify_all();
+        std::unique_lock<std::mutex> guard(donelock);
+        done.wait(guard, [&]{ return remaining == 0; });
+    }
+};
+
+// Ways of ordering the kernel samples. Which is fastest depends on the CPU.
+enum
+{
+    kernel_sort, // std::sort
+    kernel_insertion, // plain insertion sort, no introsort bookkeeping
+    kernel_select, // only order the middle samples the output actually uses
+    kernel_network, // fixed 16-input sorting network, no data-dependent branches
+    kernel_count,
+    kernel_original = kernel_count // the pre-kernel std::sort on triads, only for checking against
+};
+const char* kernel_names[kernel_count] = {"sort", "insertion", "select", "network"};
+
+int find_kernel(const char* name)
+{
+    for(int i = 0; i < kernel_count; i++)
+        if(strcmp(name, kernel_names[i]) == 0)
+            return i;
+    return -1;
+}
+
+// A kernel sample plus the order it was pushed in.
+struct sample
+{
+    triad value;
+    unsigned index;
+};
+
+// Sorts by brightness like triad::operator<, and breaks ties on push order.
+// That's exactly what std::sort on triads did: for lists this short it's an
+// insertion sort, which is stable. With a total order every kernel puts the
+// same sample at the same spot, so the choice of kernel can't change output.
+struct sample_order
+{
+    bool operator()(float a, float b) const
+    {
+        return a < b;
     }
-    if(argc >= n)
+    bool operator()(const sample& a, const sample& b) const
     {
-        if(strcmp(argv[n-1], "--split") == 0)
+        float suma = a.value.r+a.value.g+a.value.b;
+        float sumb = b.value.r+b.value.g+b.value.b;
+        if(suma != sumb)
+            return suma < sumb;
+        return a.index < b.index;
+    }
+};
+
+// One comparator of the sorting network.
+inline void exchange(float& a, float& b)
+{
+    float low = std::min(a, b);
+    b = std::max(a, b);
+    a = low;
+}
+inline void exchange(sample& a, sample& b)
+{
+    bool swap = sample_order()(b, a);
+    sample low = swap ? b : a;
+    b = swap ? a : b;
+    a = low;
+}
+
+// Green's 16-input network: 60 comparators in 10 layers.
+const uint8_t network16[60][2] = {
+    {0,13}, {1,12}, {2,15}, {3,14}, {4,8}, {5,6}, {7,11}, {9,10},
+    {0,5}, {1,7}, {2,9}, {3,4}, {6,13}, {8,14}, {10,15}, {11,12},
+    {0,1}, {2,3}, {4,5}, {6,8}, {7,9}, {10,11}, {12,13}, {14,15},
+    {0,2}, {1,3}, {4,10}, {5,11}, {6,7}, {8,9}, {12,14}, {13,15},
+    {1,2}, {3,12}, {4,6}, {5,7}, {8,10}, {9,11}, {13,14},
+    {1,4}, {2,6}, {5,8}, {7,10}, {9,13}, {11,14},
+    {2,4}, {3,6}, {9,12}, {11,13},
+    {3,5}, {6,8}, {7,9}, {10,12},
+    {3,4}, {5,6}, {7,8}, {9,10}, {11,12},
+    {6,7}, {8,9}
+};
+
+inline void pad(float& f)
+{
+    f = INFINITY;
+}
+inline void pad(sample& s)
+{
+    s.value = triad(INFINITY, INFINITY, INFINITY);
+    s.index = 16;
+}
+
+// Puts list[lo] through list[hi-1] where they'd be if the list were sorted.
+// Everything else may be left in any order. list must have room for 16.
+template <typename T>
+void order(T* list, unsigned count, unsigned lo, unsigned hi, int kernel)
+{
+    sample_order less;
+    if(kernel == kernel_insertion)
+    {
+        for(unsigned i = 1; i < count; i++)
         {
-            split = 1;
-            puts("Split channel mode.");
-            n += 1;
+            T value = list[i];
+            unsigned j = i;
+            for(; j > 0 and less(value, list[j-1]); j--)
+                list[j] = list[j-1];
+            list[j] = value;
         }
     }
+    else if(kernel == kernel_select and lo < hi and hi-lo < count)
+    {
+        std::nth_element(list, list+lo, list+count, less);
+        std::partial_sort(list+lo+1, list+hi, list+count, less);
+    }
+    else if(kernel == kernel_network)
+    {
+        // Edge pixels have fewer samples. Padding sorts to the end.
+        for(unsigned i = count; i < 16; i++)
+            pad(list[i]);
+        for(auto& comparator : network16)
+            exchange(list[comparator[0]], list[comparator[1]]);
+    }
+    else
+        std::sort(list, list+count, less);
+}
+
+// How to split up and run the filter. Never changes the output.
+struct tuning
+{
+    int kernel;
+    unsigned band; // rows are handed to the pool in bands of this many
+    unsigned threads;
     
-    if(dolinear)
-        img.makelinear_worse();
-    
-    for(unsigned int x = 0; x < img.width; x++)
+    tuning()
     {
-        for(unsigned int y = 0; y < img.height; y++)
+        kernel = kernel_sort;
+        band = 16;
+        threads = std::max(1u, std::thread::hardware_concurrency());
+    }
+};
+
+// Filters rows top through bottom-1 of img into dest.
+void median_rows(image& img, image& dest, const filter_options& options, int kernel, unsigned top, unsigned bottom)
+{
+    int blurry = options.blurry;
+    for(unsigned int y = top; y < bottom; y++)
+    {
+        for(unsigned int x = 0; x < img.width; x++)
         {
-            std::vector<triad> testpixels;
+            // The kernel is never more than 16 samples, so this lives on the stack.
+            triad testpixels[16];
+            unsigned count = 0;
             // Kernel: 121 \n 242 \n 121
             // Implemented by duplication.
             auto push = [&](long ax, long ay)
             {
                 if(ax >= 0 and ax < img.width and ay >= 0 and ay < img.height)
-                    testpixels.push_back(img(ax,ay));
+                    testpixels[count++] = img(ax,ay);
             };
             
             push(x-1, y-1);
@@ -163,35 +362,53 @@ int main(int argc, const char* argv[])
             push(x, y);
             push(x, y);
             
-            if(split)
+            // The part of the sorted list that the output below reads.
+            unsigned lo = 0;
+            unsigned hi = count;
+            if(blurry < 3 and count >= 2*(unsigned)blurry+2)
+            {
+                lo = (count-1)/2 - blurry;
+                hi = count/2 + blurry + 1;
+            }
+            
+            if(options.split)
             {
-                std::vector<float> r, g, b;
-                for(auto pixel : testpixels)
+                float r[16], g[16], b[16];
+                for(unsigned i = 0; i < count; i++)
                 {
-                    r.push_back(pixel.r);
-                    g.push_back(pixel.g);
-                    b.push_back(pixel.b);
+                    r[i] = testpixels[i].r;
+                    g[i] = testpixels[i].g;
+                    b[i] = testpixels[i].b;
                 }
-                std::sort(r.begin(), r.end());
-                std::sort(g.begin(), g.end());
-                std::sort(b.begin(), b.end());
-                for(unsigned i = 0; i < testpixels.size(); i++)
+                order(r, count, lo, hi, kernel);
+                order(g, count, lo, hi, kernel);
+                order(b, count, lo, hi, kernel);
+                for(unsigned i = 0; i < count; i++)
                     testpixels[i] = {r[i], g[i], b[i]};
             }
+            else if(kernel == kernel_original)
+                std::sort(testpixels, testpixels+count);
             else
-                std::sort(testpixels.begin(), testpixels.end());
+            {
+                sample list[16];
+                for(unsigned i = 0; i < count; i++)
+                    list[i] = {testpixels[i], i};
+                order(list, count, lo, hi, kernel);
+                for(unsigned i = 0; i < count; i++)
+                    testpixels[i] = list[i].value;
+            }
             
             // A one-dimensional image with at least two pixels has a minimum kernel size of two pixels: center and side.
             // Sides are weighted at 2, and center is weighted at 4. We shouldn't run this cout statement.
             // If we do, something broke very horribly.
-            if(testpixels.size() < 6)
-                std::cout << testpixels.size() << " " << x << " " << y << " -- kernelsize, x, y \n";
+            if(count < 6)
+                std::cout << count << " " << x << " " << y << " -- kernelsize, x, y \n";
             
             if(blurry < 3)
             {
-                if((testpixels.size()&1) == 1)
+                if((count&1) == 1)
                 {
-                    auto mid = (testpixels.size()-1)/2;
+                    auto mid = (count-1)/2;
                     if(blurry == 0)
                     {
                         dest(x,y) = testpixels[mid];
@@ -215,7 +432,7 @@ int main(int argc, const char* argv[])
                 }
                 else // even number of cells
                 {
-                    auto topmid = testpixels.size()/2;
+                    auto topmid = count/2;
                     if(blurry == 0)
                     {
                         // 2 width
@@ -244,10 +461,10 @@ int main(int argc, const char* argv[])
             }
             else if (blurry == 3)
             {
-                float mid = (testpixels.size()-1)/2.0;
+                float mid = (count-1)/2.0;
                 triad scrap(0,0,0);
                 float normalize = 0;
-                for(unsigned i = 0; i < testpixels.size(); i++)
+                for(unsigned i = 0; i < count; i++)
                 {
                     float factor = mid-fabs(i-mid);
                     factor += 1;
@@ -311,10 +528,769 @@ int main(int argc, const char* argv[])
             }*/
         }
     }
+}
+
+void run_median(image& img, image& dest, const filter_options& options, const tuning& tune, workpool& pool)
+{
+    dest.dimensions(img.width, img.height);
+    unsigned bands = (img.height+tune.band-1)/tune.band;
+    pool.run(bands, [&](unsigned i)
+    {
+        median_rows(img, dest, options, tune.kernel, i*tune.band, std::min(img.height, (i+1)*tune.band));
+    });
+}
+
+// The tuning cache. It remembers the host it was made on, so a home
+// directory shared between different machines doesn't hand out wrong answers.
+std::string tuning_path()
+{
+    if(const char* path = getenv("MEDIAN_TUNING"))
+        return path;
+    if(const char* cache = getenv("XDG_CACHE_HOME"))
+        return std::string(cache) + "/median-tuning";
+    if(const char* home = getenv("HOME"))
+        return std::string(home) + "/.cache/median-tuning";
+    return "median-tuning";
+}
+std::string hostname()
+{
+    char name[256] = {};
+    gethostname(name, sizeof(name)-1);
+    return name;
+}
+
+bool load_tuning(tuning& tune)
+{
+    std::string path = tuning_path();
+    FILE* file = fopen(path.data(), "r");
+    if(file == NULL)
+        return false;
+    char host[256] = {};
+    char kernel[32] = {};
+    unsigned band = 0;
+    unsigned threads = 0;
+    bool valid = fscanf(file, "host %255s kernel %31s band %u threads %u", host, kernel, &band, &threads) == 4
+             and hostname() == host and find_kernel(kernel) >= 0 and band > 0 and threads > 0;
+    fclose(file);
+    if(!valid)
+        return false;
+    tune.kernel = find_kernel(kernel);
+    tune.band = band;
+    tune.threads = threads;
+    return true;
+}
+// Creates every missing directory leading up to path, like mkdir -p on its
+// parent. Returns false if the file's directory isn't writable in the end.
+bool make_parents(const std::string& path)
+{
+    size_t slash = path.rfind('/');
+    if(slash == std::string::npos)
+        return access(".", W_OK) == 0;
+    std::string directory = path.substr(0, slash);
+    for(size_t i = 1; i <= directory.size(); i++)
+    {
+        if(i == directory.size() or directory[i] == '/')
+            mkdir(directory.substr(0, i).data(), 0755); // EEXIST is fine
+    }
+    return access(directory.empty() ? "/" : directory.data(), W_OK) == 0;
+}
+
+bool save_tuning(const tuning& tune)
+{
+    std::string path = tuning_path();
+    make_parents(path);
+    FILE* file = fopen(path.data(), "w");
+    if(file == NULL)
+    {
+        perror(path.data());
+        return false;
+    }
+    fprintf(file, "host %s\nkernel %s\nband %u\nthreads %u\n", hostname().data(), kernel_names[tune.kernel], tune.band, tune.threads);
+    fclose(file);
+    printf("Saved to %s\n", path.data());
+    return true;
+}
+
+// Checks that a kernel gives exactly what the original std::sort on triads
+// gives, in every mode, on samples that all tie on brightness.
+bool kernel_matches(int kernel, workpool& pool)
+{
+    image img;
+    img.dimensions(64, 64);
+    const float levels[3] = {0.1, 0.3, 0.5};
+    const int permutations[6][3] = {{0,1,2}, {0,2,1}, {1,0,2}, {1,2,0}, {2,0,1}, {2,1,0}};
+    for(unsigned i = 0; i < img.data.size(); i++)
+    {
+        auto& p = permutations[(i*7 + i/64*3)%6];
+        img.data[i] = triad(levels[p[0]], levels[p[1]], levels[p[2]]);
+    }
+    tuning reference;
+    reference.kernel = kernel_original;
+    tuning candidate = reference;
+    candidate.kernel = kernel;
+    image expected;
+    image got;
+    for(int split = 0; split < 2; split++)
+    {
+        for(int blurry = 0; blurry < 4; blurry++)
+        {
+            filter_options options;
+            options.split = split;
+            options.blurry = blurry;
+            run_median(img, expected, options, reference, pool);
+            run_median(img, got, options, candidate, pool);
+            if(memcmp(expected.data.data(), got.data.data(), got.data.size()*sizeof(triad)) != 0)
+                return false;
+        }
+    }
+    return true;
+}
+
+// Times every kernel, band height and thread count on a synthetic image and
+// saves the fastest combination. Any field of forced that's set (kernel >= 0,
+// band or threads > 0) is held fixed instead of searched.
+int tune_machine(const tuning& forced)
+{
+    // Check this up front rather than after the whole benchmark.
+    std::string path = tuning_path();
+    if(!make_parents(path))
+    {
+        printf("Can't write %s.\n", path.data());
+        return 1;
+    }
+    
+    // Noise over gradients: a mix of easy and hard samples to order.
+    image img;
+    img.dimensions(512, 512);
+    uint32_t seed = 1;
+    for(unsigned y = 0; y < img.height; y++)
+    {
+        for(unsigned x = 0; x < img.width; x++)
+        {
+            seed = seed*1664525 + 1013904223;
+            float noise = (seed>>8)*(1.0/(1<<24)) - 0.5;
+            img(x,y) = triad(x/512.0, y/512.0, 0.5+noise*0.25);
+        }
+    }
+    image dest;
+    
+    std::vector<int> kernels;
+    {
+        workpool pool(1);
+        for(int kernel = 0; kernel < kernel_count; kernel++)
+        {
+            if(forced.kernel >= 0 and kernel != forced.kernel)
+                continue;
+            if(kernel_matches(kernel, pool))
+                kernels.push_back(kernel);
+            else
+                printf("%-10s gives different output, skipping\n", kernel_names[kernel]);
+        }
+    }
+    if(kernels.empty())
+        return 1;
+    
+    std::vector<unsigned> thread_counts;
+    unsigned hardware = std::max(1u, std::thread::hardware_concurrency());
+    if(forced.threads > 0)
+        thread_counts.push_back(forced.threads);
+    else
+    {
+        for(unsigned n = 1; n < hardware; n *= 2)
+            thread_counts.push_back(n);
+        thread_counts.push_back(hardware);
+    }
+    std::vector<unsigned> bands = {4, 16, 64};
+    if(forced.band > 0)
+        bands = {forced.band};
+    
+    tuning best;
+    double besttime = INFINITY;
+    for(unsigned threads : thread_counts)
+    {
+        workpool pool(threads);
+        for(int kernel : kernels)
+        {
+            for(unsigned band : bands)
+            {
+                tuning tune;
+                tune.kernel = kernel;
+                tune.band = band;
+                tune.threads = threads;
+                // Best of a few runs, each doing the plain and the split filter.
+                double fastest = INFINITY;
+                for(int attempt = 0; attempt < 4; attempt++)
+                {
+                    filter_options plain;
+                    filter_options split;
+                    split.split = true;
+                    auto before = std::chrono::steady_clock::now();
+                    run_median(img, dest, plain, tune, pool);
+                    run_median(img, dest, split, tune, pool);
+                    std::chrono::duration<double, std::milli> took = std::chrono::steady_clock::now() - before;
+                    if(attempt > 0) // first one is a warmup
+                        fastest = std::min(fastest, took.count());
+                }
+                printf("%-10s band %3u threads %3u: %8.2f ms\n", kernel_names[kernel], band, threads, fastest);
+                fflush(stdout);
+                if(fastest < besttime)
+                {
+                    besttime = fastest;
+                    best = tune;
+                }
+            }
+        }
+    }
+    printf("Best: %s, band %u, threads %u\n", kernel_names[best.kernel], best.band, best.threads);
+    return save_tuning(best) ? 0 : 1;
+}
+
+// Rows per independently encoded QOI stripe. Every stripe costs a few bytes.
+const unsigned qoi_stripe_height = 64;
+
+void encodeqoi_parallel(image& img, workpool& pool, std::vector<uint8_t>& bytes)
+{
+    std::vector<std::vector<uint8_t>> stripes((img.height+qoi_stripe_height-1)/qoi_stripe_height);
+    pool.run(stripes.size(), [&](unsigned i)
+    {
+        img.encodeqoi_stripe(i*qoi_stripe_height, std::min(img.height, (i+1)*qoi_stripe_height), stripes[i]);
+    });
+    img.stitchqoi(stripes, bytes);
+}
+
+// Socket plumbing shared by --serve and --loadgen.
+//
+// Protocol, one job per request, any number of jobs per connection:
+//   client: "[filter flags...] <source>\n"
+//           <source> is "-" to send a farbfeld file right after the line,
+//           "- <length>" to send <length> bytes of farbfeld or QOI,
+//           or a path the server should read. Paths may contain spaces.
+//   server: "ok <length>\n" followed by <length> bytes of 16-bit farbfeld
+//           (or QOI with --qoi), or "error <message>\n".
+struct connection
+{
+    int fd;
+    char buffer[4096];
+    size_t start;
+    size_t end;
+    
+    connection(int arg_fd)
+    {
+        fd = arg_fd;
+        start = 0;
+        end = 0;
+    }
+    
+    bool fill()
+    {
+        while(start == end)
+        {
+            ssize_t got = ::read(fd, buffer, sizeof(buffer));
+            if(got < 0 and errno == EINTR)
+                continue;
+            if(got <= 0)
+                return false;
+            start = 0;
+            end = got;
+        }
+        return true;
+    }
+    bool readline(std::string& line)
+    {
+        line.clear();
+        while(fill())
+        {
+            char c = buffer[start++];
+            if(c == '\n')
+                return true;
+            line += c;
+            if(line.size() > sizeof(buffer))
+                return false;
+        }
+        return false;
+    }
+    bool read(uint8_t* out, size_t length)
+    {
+        while(length > 0)
+        {
+            if(!fill())
+                return false;
+            size_t chunk = std::min(length, end-start);
+            memcpy(out, buffer+start, chunk);
+            start += chunk;
+            out += chunk;
+            length -= chunk;
+        }
+        return true;
+    }
+    // Appends length bytes to bytes, growing it only as data actually arrives
+    // so a client that sends a big header and stalls doesn't cost anything.
+    bool append(std::vector<uint8_t>& bytes, uint64_t length)
+    {
+        while(length > 0)
+        {
+            size_t chunk = std::min<uint64_t>(length, 1<<20);
+            size_t offset = bytes.size();
+            bytes.resize(offset+chunk);
+            if(!read(bytes.data()+offset, chunk))
+                return false;
+            length -= chunk;
+        }
+        return true;
+    }
+    bool write(const void* data, size_t length)
+    {
+        auto p = (const uint8_t*)data;
+        while(length > 0)
+        {
+            ssize_t sent = ::write(fd, p, length);
+            if(sent < 0 and errno == EINTR)
+                continue;
+            if(sent <= 0)
+                return false;
+            p += sent;
+            length -= sent;
+        }
+        return true;
+    }
+};
+
+bool fillsocketaddress(const char* path, sockaddr_un& address)
+{
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    if(strlen(path) >= sizeof(address.sun_path))
+    {
+        puts("Socket path is too long.");
+        return false;
+    }
+    strcpy(address.sun_path, path);
+    return true;
+}
+
+// Anything bigger than this is refused instead of allocated.
+const uint64_t serve_max_pixels = 1<<26;
+// Connections past this many are turned away, which also bounds how much
+// memory clients can have the server hold for them at once.
+const unsigned serve_max_connections = 64;
+std::atomic<unsigned> serve_connections(0);
+
+// Runs jobs on one client connection until it hangs up. The images and byte
+// buffers live as long as the connection, so repeated jobs reuse them.
+void serve_connection(int fd, workpool& pool, const tuning& tune, const gammatables& gamma)
+{
+    connection conn(fd);
+    image img;
+    image dest;
+    std::vector<uint8_t> bytes;
+    std::string line;
+    while(conn.readline(line))
+    {
+        filter_options options;
+        std::string error;
+        
+        size_t i = 0;
+        while(line.compare(i, 2, "--") == 0)
+        {
+            size_t space = line.find(' ', i);
+            if(space == std::string::npos)
+                space = line.size();
+            std::string flag = line.substr(i, space-i);
+            if(!parse_option(flag.data(), options, false) and error.empty())
+                error = "unknown option " + flag;
+            i = std::min(space+1, line.size());
+        }
+        std::string source = line.substr(i);
+        
+        if(source == "-")
+        {
+            bytes.resize(16);
+            if(!conn.read(bytes.data(), 16))
+                break;
+            uint64_t w = (uint64_t(bytes[8])<<24)|(bytes[9]<<16)|(bytes[10]<<8)|bytes[11];
+            uint64_t h = (uint64_t(bytes[12])<<24)|(bytes[13]<<16)|(bytes[14]<<8)|bytes[15];
+            // If we can't trust the header we can't find the next request either.
+            if(memcmp(bytes.data(), "farbfeld", 8) != 0 or w*h > serve_max_pixels)
+            {
+                conn.write("error bad farbfeld header\n", 26);
+                break;
+            }
+            if(!conn.append(bytes, w*h*8))
+                break;
+        }
+        else if(source.compare(0, 2, "- ") == 0)
+        {
+            uint64_t length = strtoull(source.data()+2, NULL, 10);
+            if(length > serve_max_pixels*8+16)
+            {
+                conn.write("error payload too large\n", 24);
+                break;
+            }
+            bytes.clear();
+            if(!conn.append(bytes, length))
+                break;
+        }
+        else if(source.empty())
+            error = "no source given";
+        else if(error.empty() and !readfile(source.data(), bytes))
+            error = "can't open " + source;
+        
+        if(error.empty() and !img.decode(bytes, options.dolinear ? gamma.linear.data() : nullptr, serve_max_pixels))
+            error = "not a valid farbfeld or qoi file, or too large";
+        
+        if(!error.empty())
+        {
+            error = "error " + error + "\n";
+            if(!conn.write(error.data(), error.size()))
+                break;
+            continue;
+        }
+        
+        if(img.width * img.height == 1)
+            dest = img;
+        else
+            run_median(img, dest, options, tune, pool);
+        if(options.dolinear)
+            dest.makesrgb_worse();
+        
+        if(options.qoi)
+            encodeqoi_parallel(dest, pool, bytes);
+        else
+            dest.encodeff(bytes);
+        std::string header = "ok " + std::to_string(bytes.size()) + "\n";
+        if(!conn.write(header.data(), header.size()) or !conn.write(bytes.data(), bytes.size()))
+            break;
+    }
+    close(fd);
+    serve_connections--;
+}
+
+int serve(const char* path, workpool& pool, const tuning& tune, const gammatables& gamma)
+{
+    // Clients hanging up mid-reply shouldn't take the server with them.
+    signal(SIGPIPE, SIG_IGN);
+    
+    sockaddr_un address;
+    if(!fillsocketaddress(path, address))
+        return 1;
+    int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+    if(listener < 0)
+    {
+        perror("socket");
+        return 1;
+    }
+    // Only clear out a stale socket from a previous run, never anything else.
+    struct stat existing;
+    if(lstat(path, &existing) == 0)
+    {
+        if(!S_ISSOCK(existing.st_mode))
+        {
+            printf("%s exists and is not a socket.\n", path);
+            close(listener);
+            return 1;
+        }
+        unlink(path);
+    }
+    if(bind(listener, (sockaddr*)&address, sizeof(address)) != 0 or listen(listener, 64) != 0)
+    {
+        perror(path);
+        close(listener);
+        return 1;
+    }
+    printf("Serving on %s with %zu threads, %s kernel, band %u.\n", path, pool.threads.size(), kernel_names[tune.kernel], tune.band);
+    fflush(stdout);
+    
+    while(true)
+    {
+        int fd = accept(listener, NULL, NULL);
+        if(fd < 0)
+        {
+            if(errno == EINTR or errno == ECONNABORTED)
+                continue;
+            perror("accept");
+            close(listener);
+            return 1;
+        }
+        if(serve_connections >= serve_max_connections)
+        {
+            const char busy[] = "error too many connections\n";
+            connection(fd).write(busy, sizeof(busy)-1);
+            close(fd);
+            continue;
+        }
+        serve_connections++;
+        std::thread(serve_connection, fd, std::ref(pool), std::cref(tune), std::cref(gamma)).detach();
+    }
+}
+
+// Local load generator for --serve. Every client thread keeps one connection
+// open and sends the same farbfeld file over and over.
+int loadgen(int argc, const char* argv[])
+{
+    if(argc < 4)
+    {
+        puts("Usage: median --loadgen <socket-path> <filename> [--concurrency N] [--requests N] [filter flags...]");
+        return 1;
+    }
+    const char* path = argv[2];
+    unsigned concurrency = 1;
+    unsigned requests = 100;
+    std::string request;
+    for(int n = 4; n < argc; n++)
+    {
+        filter_options ignored;
+        if(strcmp(argv[n], "--concurrency") == 0 and n+1 < argc)
+            concurrency = std::max(1, atoi(argv[++n]));
+        else if(strcmp(argv[n], "--requests") == 0 and n+1 < argc)
+            requests = std::max(1, atoi(argv[++n]));
+        else if(parse_option(argv[n], ignored, false))
+            request += std::string(argv[n]) + " ";
+        else
+            printf("Unknown option %s, ignoring.\n", argv[n]);
+    }
+    
+    std::vector<uint8_t> payload;
+    if(!readfile(argv[3], payload))
+    {
+        puts("Error opening file.");
+        return 1;
+    }
+    image probe;
+    if(!probe.decode(payload))
+    {
+        puts("Not a valid farbfeld or qoi file.");
+        return 1;
+    }
+    request += "- " + std::to_string(payload.size()) + "\n";
+    sockaddr_un address;
+    if(!fillsocketaddress(path, address))
+        return 1;
+    signal(SIGPIPE, SIG_IGN);
+    
+    std::vector<std::vector<double>> latencies(concurrency);
+    std::vector<unsigned> failures(concurrency);
+    std::vector<std::thread> clients;
+    auto started = std::chrono::steady_clock::now();
+    for(unsigned c = 0; c < concurrency; c++)
+    {
+        // Spread the remainder over the first few clients.
+        unsigned share = requests/concurrency + (c < requests%concurrency ? 1 : 0);
+        clients.emplace_back([&, c, share]()
+        {
+            int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+            if(fd < 0 or connect(fd, (const sockaddr*)&address, sizeof(address)) != 0)
+            {
+                failures[c] = share;
+                if(fd >= 0)
+                    close(fd);
+                return;
+            }
+            connection conn(fd);
+            std::string line;
+            std::vector<uint8_t> reply;
+            for(unsigned i = 0; i < share; i++)
+            {
+                auto before = std::chrono::steady_clock::now();
+                if(!conn.write(request.data(), request.size())
+                or !conn.write(payload.data(), payload.size())
+                or !conn.readline(line))
+                {
+                    failures[c] += share-i;
+                    break;
+                }
+                if(line.compare(0, 3, "ok ") != 0)
+                {
+                    failures[c] += 1;
+                    continue;
+                }
+                reply.resize(strtoull(line.data()+3, NULL, 10));
+                if(!conn.read(reply.data(), reply.size()))
+                {
+                    failures[c] += share-i;
+                    break;
+                }
+                std::chrono::duration<double, std::milli> took = std::chrono::steady_clock::now() - before;
+                latencies[c].push_back(took.count());
+            }
+            close(fd);
+        });
+    }
+    for(auto& client : clients)
+        client.join();
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - started;
+    
+    std::vector<double> all;
+    unsigned failed = 0;
+    for(unsigned c = 0; c < concurrency; c++)
+    {
+        all.insert(all.end(), latencies[c].begin(), latencies[c].end());
+        failed += failures[c];
+    }
+    std::sort(all.begin(), all.end());
+    printf("%zu ok, %u failed, %u clients, %ux%u image\n", all.size(), failed, concurrency, probe.width, probe.height);
+    if(all.empty())
+        return 1;
+    auto percentile = [&](double p)
+    {
+        return all[(size_t)((all.size()-1)*p + 0.5)];
+    };
+    printf("latency ms: p50 %.3f  p99 %.3f  max %.3f\n", percentile(0.5), percentile(0.99), all.back());
+    printf("throughput: %.1f jobs/s, %.2f Mpx/s\n", all.size()/elapsed.count(), all.size()*probe.width*probe.height/elapsed.count()/1e6);
+    return failed != 0;
+}
+
+int main(int argc, const char* argv[])
+{
+    if(argc == 1 or strcmp(argv[1], "--help") == 0 or strcmp(argv[1], "-h") == 0)
+    {
+        puts("Usage: median <filename> [--srgb] [--blurry|blurrier|special] [--split] [--qoi]");
+        puts("       median --serve <socket-path>");
+        puts("       median --loadgen <socket-path> <filename> [--concurrency N] [--requests N] [flags]");
+        puts("       median --tune");
+        puts("Filtering, --serve and --tune also take [--kernel sort|insertion|select|network]");
+        puts("[--band N] [--threads N]");
+        puts("<filename> must be a farbfeld image file with the .ff extension present,");
+        puts("or a QOI image file with the .qoi extension present.");
+        puts("If <filename> has an extension, the output will contain it: 'fab.ff.ppm'");
+        puts("The output filename uses the input filename with the ppm file extension.");
+        puts("");
+        puts("All filtering is done in linear RGB by default. Add '--srgb' immediately");
+        puts("after the input filename to filter in sRGB gamma. Sometimes fixes moire.");
+        puts("");
+        puts("'--blurry' makes the filter blend multiple kernel pixel values together.");
+        puts("It's nearly invisible, but *does* smooth certain features very slightly.");
+        puts("");
+        puts("'--blurrier' is like '--blurry', but blends more tentative pixel values.");
+        puts("It's much stronger, and can make or break the filtering of some artwork.");
+        puts("");
+        puts("'--special' does not weight the median but instead blurs the median set.");
+        puts("The median set is blurred with a triangle kernel that catches the edges.");
+        puts("This is done after sorting, so it's different from straightforward blur.");
+        puts("It's almost as sharp as a 2x2 blur but with less noise, and is centered.");
+        puts("");
+        puts("'--split' performs the sorting on each separate RGB channel, rather than");
+        puts("on the broad pixel value as a whole. Good for strong dithered pixel art.");
+        puts("");
+        puts("'--qoi' writes a losslessly compressed QOI file instead of a ppm file.");
+        puts("The output filename always gets .qoi appended: 'fab.ff.qoi'");
+        puts("");
+        puts("'--serve' keeps threads and tables warm and takes jobs over a unix socket.");
+        puts("Send a line of flags ending in '-' then a farbfeld file, '- <length>'");
+        puts("then a farbfeld or QOI file of that length, or flags and a path. You get");
+        puts("back 'ok <length>' and a farbfeld (or QOI) file, or 'error <why>'.");
+        puts("'--loadgen' hammers a server with a file and reports latency/throughput.");
+        puts("");
+        puts("'--tune' times the filter's kernels, band heights and thread counts on");
+        puts("this machine and saves the fastest to ~/.cache/median-tuning, which is");
+        puts("then used automatically. '--kernel', '--band' and '--threads' override.");
+        puts("Given to '--tune', they pin that setting and only search the others.");
+        puts("");
+        puts("ppm is a very old text-based image format that is very easy to generate.");
+        puts("For software that can open ppm images, I use KolourPaint, a Paint clone.");
+        puts("");
+        puts("farbfeld is a binary image format. It is very extremely easy to process.");
+        puts("For software for using farbfeld, see http://tools.suckless.org/farbfeld/");
+        return 0;
+    }
+    
+    // Pull the tuning overrides out first, wherever they are.
+    tuning forced;
+    forced.kernel = -1;
+    forced.band = 0;
+    forced.threads = 0;
+    std::vector<const char*> args;
+    for(int n = 0; n < argc; n++)
+    {
+        bool hasvalue = n+1 < argc;
+        if(strcmp(argv[n], "--kernel") == 0 and hasvalue)
+        {
+            forced.kernel = find_kernel(argv[++n]);
+            if(forced.kernel < 0)
+            {
+                printf("Unknown kernel %s.\n", argv[n]);
+                return 1;
+            }
+        }
+        else if(strcmp(argv[n], "--band") == 0 and hasvalue)
+            forced.band = std::max(1, atoi(argv[++n]));
+        else if(strcmp(argv[n], "--threads") == 0 and hasvalue)
+            forced.threads = std::max(1, atoi(argv[++n]));
+        else
+            args.push_back(argv[n]);
+    }
+    argc = args.size();
+    argv = args.data();
+    
+    if(argc >= 2 and strcmp(argv[1], "--tune") == 0)
+        return tune_machine(forced);
+    
+    tuning tune;
+    bool tuned = load_tuning(tune);
+    if(forced.kernel >= 0)
+        tune.kernel = forced.kernel;
+    if(forced.band > 0)
+        tune.band = forced.band;
+    if(forced.threads > 0)
+        tune.threads = forced.threads;
+    
+    if(argc < 2)
+    {
+        puts("No input file given.");
+        return 1;
+    }
+    
+    if(strcmp(argv[1], "--loadgen") == 0)
+        return loadgen(argc, argv);
+    
+    if(tuned)
+        printf("Using tuning from %s.\n", tuning_path().data());
+    workpool pool(tune.threads);
+    gammatables gamma;
+    
+    if(strcmp(argv[1], "--serve") == 0)
+    {
+        if(argc < 3)
+        {
+            puts("Usage: median --serve <socket-path>");
+            return 1;
+        }
+        return serve(argv[2], pool, tune, gamma);
+    }
+    
+    filter_options options;
+    for(int n = 2; n < argc; n++)
+    {
+        if(!parse_option(argv[n], options, true))
+            printf("Unknown option %s, ignoring.\n", argv[n]);
+    }
+    
+    image img;
+    const float* table = options.dolinear ? gamma.linear.data() : nullptr;
+    size_t length = strlen(argv[1]);
+    bool isqoi = length > 4 and strcmp(argv[1]+length-4, ".qoi") == 0;
+    if(!(isqoi ? img.readqoi(argv[1], table) : img.readff(argv[1], table)))
+        return 1;
+    image dest;
+    
+    if(img.width * img.height == 1)
+    {
+        puts("Nothing to do. Image is only one pixel large. Output not written.");
+        return 0;
+    }
+    
+    puts("Running median");
+    run_median(img, dest, options, tune, pool);
     puts("Done.");
     
-    if(dolinear)
+    if(options.dolinear)
         dest.makesrgb_worse();
     
-    dest.writeppm(argv[1]);
+    if(options.qoi)
+    {
+        std::vector<uint8_t> bytes;
+        encodeqoi_parallel(dest, pool, bytes);
+        dest.writeqoi(argv[1], &bytes);
+    }
+    else
+        dest.writeppm(argv[1]);
 }